@@ -4,29 +4,779 @@
 #include <stdlib.h>
 #include <string.h> /* memcpy */
 
+/*
+ * program i/o
+ * generated code reads and writes through s4io_* instead of stdio directly.
+ * by default these are plain stdio calls; with S4_ASYNC_IO defined, each
+ * stream gets a background thread that reads ahead into (or drains) a ring
+ * of buffers, so compute overlaps with the actual i/o.
+ */
+
+// reads at most max bytes into dst, stopping after delim unless it is EOF
+size_t s4io_readDirect(unsigned char* dst, size_t max, int delim, FILE* file) {
+    if(delim == EOF) {
+        return fread(dst, 1, max, file);
+    }
+    size_t n = 0;
+    int c;
+    while(n < max && (c = getc(file)) != EOF) {
+        dst[n++] = c;
+        if(c == delim) {
+            break;
+        }
+    }
+    return n;
+}
+
+#ifdef S4_ASYNC_IO
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define S4IO_BUFFERS        (4)
+#define S4IO_BUFSIZE        (1 << 16)
+#define S4IO_MAX_STREAMS    (8)
+#define S4IO_PUSHBACK       (2)
+
+typedef struct s4io {
+    FILE* file;
+    int writing;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char* bufs[S4IO_BUFFERS];
+    size_t lens[S4IO_BUFFERS];
+    size_t head;    // next slot the producer fills
+    size_t tail;    // next slot the consumer drains
+    size_t count;   // filled slots
+    size_t pos;     // main thread's offset into its current slot
+    size_t avail;   // reader: bytes in the slot the main thread holds
+    int done;       // reader: end of stream; writer: stop requested
+    int pushback[S4IO_PUSHBACK];
+    int pushed;
+} s4io;
+
+s4io* s4io_streams[S4IO_MAX_STREAMS];
+s4io* s4io_lastIn = NULL;
+s4io* s4io_lastOut = NULL;
+
+void* s4io_readAhead(void* arg) {
+    s4io* io = arg;
+    while(1) {
+        pthread_mutex_lock(&io->lock);
+        while(io->count == S4IO_BUFFERS && !io->done) {
+            pthread_cond_wait(&io->cond, &io->lock);
+        }
+        if(io->done) {
+            pthread_mutex_unlock(&io->lock);
+            break;
+        }
+        size_t slot = io->head;
+        pthread_mutex_unlock(&io->lock);
+
+        // read(2) returns whatever is available, so a slow pipe or terminal
+        // hands each chunk on as soon as it arrives instead of filling a slot
+        ssize_t n;
+        do {
+            n = read(fileno(io->file), io->bufs[slot], S4IO_BUFSIZE);
+        } while(n < 0 && errno == EINTR);
+
+        pthread_mutex_lock(&io->lock);
+        if(n > 0) {
+            io->lens[slot] = n;
+            io->head = (slot + 1) % S4IO_BUFFERS;
+            io->count++;
+        }
+        else {
+            io->done = 1;
+        }
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+    }
+    return NULL;
+}
+
+void* s4io_writeBehind(void* arg) {
+    s4io* io = arg;
+    while(1) {
+        pthread_mutex_lock(&io->lock);
+        while(io->count == 0 && !io->done) {
+            pthread_cond_wait(&io->cond, &io->lock);
+        }
+        if(io->count == 0) {
+            pthread_mutex_unlock(&io->lock);
+            break;
+        }
+        size_t slot = io->tail;
+        pthread_mutex_unlock(&io->lock);
+
+        fwrite(io->bufs[slot], 1, io->lens[slot], io->file);
+        fflush(io->file);
+
+        pthread_mutex_lock(&io->lock);
+        io->tail = (slot + 1) % S4IO_BUFFERS;
+        io->count--;
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+    }
+    return NULL;
+}
+
+// hand the main thread's current output slot to the writer thread
+void s4io_submit(s4io* io) {
+    pthread_mutex_lock(&io->lock);
+    io->lens[io->head] = io->pos;
+    io->head = (io->head + 1) % S4IO_BUFFERS;
+    io->count++;
+    pthread_cond_broadcast(&io->cond);
+    while(io->count == S4IO_BUFFERS) {
+        pthread_cond_wait(&io->cond, &io->lock);
+    }
+    pthread_mutex_unlock(&io->lock);
+    io->pos = 0;
+}
+
+// wait until everything written so far has reached the underlying stream
+void s4io_drain(s4io* io) {
+    if(io->pos) {
+        s4io_submit(io);
+    }
+    pthread_mutex_lock(&io->lock);
+    while(io->count) {
+        pthread_cond_wait(&io->cond, &io->lock);
+    }
+    pthread_mutex_unlock(&io->lock);
+}
+
+void s4io_detach(s4io* io) {
+    if(io->writing) {
+        s4io_drain(io);
+    }
+    pthread_mutex_lock(&io->lock);
+    io->done = 1;
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+    pthread_join(io->thread, NULL);
+
+    for(size_t i = 0; i < S4IO_MAX_STREAMS; i++) {
+        if(s4io_streams[i] == io) {
+            s4io_streams[i] = NULL;
+        }
+    }
+    if(s4io_lastIn == io) s4io_lastIn = NULL;
+    if(s4io_lastOut == io) s4io_lastOut = NULL;
+    for(size_t i = 0; i < S4IO_BUFFERS; i++) {
+        free(io->bufs[i]);
+    }
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->cond);
+    free(io);
+}
+
+void s4io_shutdown(void) {
+    for(size_t i = 0; i < S4IO_MAX_STREAMS; i++) {
+        if(s4io_streams[i] && s4io_streams[i]->writing) {
+            s4io_detach(s4io_streams[i]);
+        }
+    }
+}
+
+s4io* s4io_find(FILE* file, int writing) {
+    for(size_t i = 0; i < S4IO_MAX_STREAMS; i++) {
+        s4io* io = s4io_streams[i];
+        if(io && io->file == file && io->writing == writing) {
+            return io;
+        }
+    }
+    return NULL;
+}
+
+s4io* s4io_attach(FILE* file, int writing) {
+    s4io* io = s4io_find(file, writing);
+    if(io) {
+        return io;
+    }
+    size_t slot = 0;
+    while(slot < S4IO_MAX_STREAMS && s4io_streams[slot]) {
+        slot++;
+    }
+    if(slot == S4IO_MAX_STREAMS) {
+        fprintf(stderr, "Too many open streams\n");
+        exit(2);
+    }
+    static int registered = 0;
+    if(!registered) {
+        atexit(s4io_shutdown);
+        registered = 1;
+    }
+    io = calloc(1, sizeof(s4io));
+    if(io == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(2);
+    }
+    io->file = file;
+    io->writing = writing;
+    for(size_t i = 0; i < S4IO_BUFFERS; i++) {
+        io->bufs[i] = malloc(S4IO_BUFSIZE);
+        if(io->bufs[i] == NULL) {
+            fprintf(stderr, "Memory allocation failure\n");
+            exit(2);
+        }
+    }
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+    if(pthread_create(&io->thread, NULL, writing ? s4io_writeBehind : s4io_readAhead, io)) {
+        fprintf(stderr, "Could not start i/o thread\n");
+        exit(2);
+    }
+    s4io_streams[slot] = io;
+    return io;
+}
+
+// in-memory streams (fmemopen, as used for batch records) have no file
+// descriptor and nothing to wait on, so they stay on plain stdio: NULL
+s4io* s4io_input(FILE* file) {
+    if(s4io_lastIn == NULL || s4io_lastIn->file != file) {
+        if(fileno(file) < 0) {
+            return NULL;
+        }
+        s4io_lastIn = s4io_attach(file, 0);
+    }
+    return s4io_lastIn;
+}
+
+s4io* s4io_output(FILE* file) {
+    if(s4io_lastOut == NULL || s4io_lastOut->file != file) {
+        if(fileno(file) < 0) {
+            return NULL;
+        }
+        s4io_lastOut = s4io_attach(file, 1);
+    }
+    return s4io_lastOut;
+}
+
+void s4io_sync(FILE* file) {
+    s4io* io = s4io_find(file, 1);
+    if(io) {
+        s4io_drain(io);
+    }
+}
+
+// moves the main thread on to the next filled input slot, blocking if needed
+// returns 0 at end of stream
+int s4io_fill(s4io* io) {
+    pthread_mutex_lock(&io->lock);
+    if(io->avail) {
+        // current slot exhausted; hand it back to the reader
+        io->tail = (io->tail + 1) % S4IO_BUFFERS;
+        io->count--;
+        io->avail = io->pos = 0;
+        pthread_cond_broadcast(&io->cond);
+    }
+    if(io->count == 0 && !io->done) {
+        // about to block on input: let pending output (e.g. prompts) out first
+        pthread_mutex_unlock(&io->lock);
+        for(size_t i = 0; i < S4IO_MAX_STREAMS; i++) {
+            if(s4io_streams[i] && s4io_streams[i]->writing) {
+                s4io_drain(s4io_streams[i]);
+            }
+        }
+        pthread_mutex_lock(&io->lock);
+        while(io->count == 0 && !io->done) {
+            pthread_cond_wait(&io->cond, &io->lock);
+        }
+    }
+    if(io->count) {
+        io->avail = io->lens[io->tail];
+    }
+    pthread_mutex_unlock(&io->lock);
+    return io->avail != 0;
+}
+
+int s4io_getc(FILE* file) {
+    s4io* io = s4io_input(file);
+    if(io == NULL) {
+        return getc(file);
+    }
+    if(io->pushed) {
+        return io->pushback[--io->pushed];
+    }
+    if(io->pos == io->avail && !s4io_fill(io)) {
+        return EOF;
+    }
+    return io->bufs[io->tail][io->pos++];
+}
+
+size_t s4io_readUntil(unsigned char* dst, size_t max, int delim, FILE* file) {
+    s4io* io = s4io_input(file);
+    if(io == NULL) {
+        return s4io_readDirect(dst, max, delim, file);
+    }
+    size_t n = 0;
+    while(n < max && io->pushed) {
+        dst[n++] = io->pushback[--io->pushed];
+        if(dst[n - 1] == delim) {
+            return n;
+        }
+    }
+    while(n < max) {
+        if(io->pos == io->avail && !s4io_fill(io)) {
+            break;
+        }
+        unsigned char* src = io->bufs[io->tail] + io->pos;
+        size_t len = io->avail - io->pos;
+        if(len > max - n) {
+            len = max - n;
+        }
+        unsigned char* hit = delim == EOF ? NULL : memchr(src, delim, len);
+        if(hit) {
+            len = hit - src + 1;
+        }
+        memcpy(dst + n, src, len);
+        io->pos += len;
+        n += len;
+        if(hit) {
+            break;
+        }
+    }
+    return n;
+}
+
+int s4io_ungetc(int c, FILE* file) {
+    s4io* io = s4io_input(file);
+    if(io == NULL) {
+        return ungetc(c, file);
+    }
+    if(io->pushed == S4IO_PUSHBACK) {
+        return EOF;
+    }
+    io->pushback[io->pushed++] = c;
+    return c;
+}
+
+void s4io_write(const void* data, size_t len, FILE* file) {
+    s4io* io = s4io_output(file);
+    if(io == NULL) {
+        fwrite(data, 1, len, file);
+        return;
+    }
+    const unsigned char* src = data;
+    while(len) {
+        size_t n = S4IO_BUFSIZE - io->pos;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(io->bufs[io->head] + io->pos, src, n);
+        io->pos += n;
+        src += n;
+        len -= n;
+        if(io->pos == S4IO_BUFSIZE) {
+            s4io_submit(io);
+        }
+    }
+}
+
+int s4io_putc(int c, FILE* file) {
+    s4io* io = s4io_output(file);
+    if(io == NULL) {
+        return putc(c, file);
+    }
+    io->bufs[io->head][io->pos++] = c;
+    if(io->pos == S4IO_BUFSIZE) {
+        s4io_submit(io);
+    }
+    return c;
+}
+
+void s4io_puts(const char* str, FILE* file) {
+    s4io_write(str, strlen(str), file);
+}
+
+// drains and stops the i/o threads of a stream the program is done with,
+// without closing it
+void s4io_forget(FILE* file) {
+    s4io* io;
+    while((io = s4io_find(file, 1)) || (io = s4io_find(file, 0))) {
+        s4io_detach(io);
+    }
+}
+
+int s4io_close(FILE* file) {
+    s4io_forget(file);
+    return fclose(file);
+}
+
+#else
+#define s4io_getc(file)             getc(file)
+#define s4io_ungetc(c, file)        ungetc(c, file)
+#define s4io_putc(c, file)          putc(c, file)
+#define s4io_puts(str, file)        fputs(str, file)
+#define s4io_write(data, len, file) fwrite(data, 1, len, file)
+#define s4io_sync(file)             ((void) 0)
+#define s4io_forget(file)           ((void) 0)
+#define s4io_close(file)            fclose(file)
+#define s4io_readUntil              s4io_readDirect
+#endif
+
+/*
+ * integer formatting and parsing for numeric `p` and `i`
+ * these avoid stdio's format parsing and locale handling entirely
+ */
+static const char s4_digitPairs[201] =
+    "00010203040506070809" "10111213141516171819"
+    "20212223242526272829" "30313233343536373839"
+    "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879"
+    "80818283848586878889" "90919293949596979899";
+
+// writes the decimal form of value so that it ends just before end
+char* s4_formatSize(size_t value, char* end) {
+    char* p = end;
+    while(value >= 100) {
+        const char* pair = s4_digitPairs + (value % 100) * 2;
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if(value >= 10) {
+        *--p = s4_digitPairs[value * 2 + 1];
+        *--p = s4_digitPairs[value * 2];
+    }
+    else {
+        *--p = '0' + value;
+    }
+    return p;
+}
+
+char* s4_formatInt(int value, char* end) {
+    char* p = s4_formatSize(value < 0 ? -(unsigned int) value : (unsigned int) value, end);
+    if(value < 0) {
+        *--p = '-';
+    }
+    return p;
+}
+
+// writes value and a newline in one go
+void s4io_putintln(int value, FILE* file) {
+    char buf[16];
+    char* end = buf + sizeof(buf);
+    end[-1] = '\n';
+    char* start = s4_formatInt(value, end - 1);
+    s4io_write(start, end - start, file);
+}
+
+// reads an optionally signed decimal integer, skipping leading whitespace
+// leaves value untouched and returns 0 if no digits were found, in which
+// case the sign (if any) is pushed back too: this needs two characters of
+// pushback, which glibc and the async reader both provide
+int s4io_getint(int* value, FILE* file) {
+    int c;
+    do {
+        c = s4io_getc(file);
+    } while(c == ' ' || (c >= '\t' && c <= '\r'));
+    int sign = EOF;
+    if(c == '-' || c == '+') {
+        sign = c;
+        c = s4io_getc(file);
+    }
+    if(c < '0' || c > '9') {
+        if(c != EOF) {
+            s4io_ungetc(c, file);
+        }
+        if(sign != EOF) {
+            s4io_ungetc(sign, file);
+        }
+        return 0;
+    }
+    unsigned int acc = 0;
+    do {
+        acc = acc * 10 + (c - '0');
+        c = s4io_getc(file);
+    } while(c >= '0' && c <= '9');
+    if(c != EOF) {
+        s4io_ungetc(c, file);
+    }
+    *value = sign == '-' ? -acc : acc;
+    return 1;
+}
+
+/*
+ * allocation telemetry
+ * with S4_TELEMETRY defined, every string bound to a register (s4str_bind)
+ * counts its allocations, reallocs, bytes copied, peak capacity and
+ * get/set calls. the counters are dumped as JSON at exit and on SIGUSR1,
+ * to stderr or to the file named by the S4_TELEMETRY environment variable.
+ * without it, S4STAT compiles to nothing.
+ */
+#ifdef S4_TELEMETRY
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct s4stat {
+    size_t allocs;
+    size_t reallocs;
+    size_t frees;
+    size_t copied;
+    size_t peak;
+    size_t gets;
+    size_t sets;
+} s4stat;
+
+s4stat s4_stats[128];
+
+#define S4STAT(str, field, n) ((str)->stat ? (void) ((str)->stat->field += (n)) : (void) 0)
+#define S4STAT_PEAK(str) \
+    ((str)->stat && (str)->stat->peak < (str)->cap ? (void) ((str)->stat->peak = (str)->cap) : (void) 0)
+
+// builds the report by hand so it can be written from a signal handler
+void s4stat_dump(void) {
+    static char buf[128 * 192];
+    static const char* names[] = {
+        "allocs", "reallocs", "frees", "bytes_copied", "peak_capacity", "gets", "sets"
+    };
+    size_t len = 0;
+    #define S4STAT_EMIT(str) { \
+        const char* s_ = (str); \
+        while(*s_) buf[len++] = *s_++; \
+    }
+    S4STAT_EMIT("{\"registers\":{");
+    int first = 1;
+    for(int reg = 0; reg < 128; reg++) {
+        s4stat* st = &s4_stats[reg];
+        if(!st->allocs) {
+            continue;
+        }
+        size_t values[] = {
+            st->allocs, st->reallocs, st->frees, st->copied, st->peak, st->gets, st->sets
+        };
+        if(!first) {
+            buf[len++] = ',';
+        }
+        first = 0;
+        buf[len++] = '"';
+        buf[len++] = reg;
+        S4STAT_EMIT("\":{");
+        for(size_t i = 0; i < sizeof(values) / sizeof(*values); i++) {
+            char num[24];
+            if(i) {
+                buf[len++] = ',';
+            }
+            buf[len++] = '"';
+            S4STAT_EMIT(names[i]);
+            S4STAT_EMIT("\":");
+            num[23] = '\0';
+            S4STAT_EMIT(s4_formatSize(values[i], num + 23));
+        }
+        buf[len++] = '}';
+    }
+    S4STAT_EMIT("}}\n");
+    #undef S4STAT_EMIT
+
+    int fd = STDERR_FILENO;
+    char* path = getenv("S4_TELEMETRY");
+    if(path && *path) {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            fd = STDERR_FILENO;
+        }
+    }
+    for(size_t off = 0; off < len; ) {
+        ssize_t n = write(fd, buf + off, len - off);
+        if(n <= 0) {
+            break;
+        }
+        off += n;
+    }
+    if(fd != STDERR_FILENO) {
+        close(fd);
+    }
+}
+
+void s4stat_signal(int sig) {
+    s4stat_dump();
+}
+#else
+#define S4STAT(str, field, n) ((void) 0)
+#define S4STAT_PEAK(str) ((void) 0)
+#endif
+
 typedef struct s4str {
     unsigned char* data;
     size_t cap;
     size_t size;
+#ifdef S4_TELEMETRY
+    s4stat* stat;
+#endif
 } s4str;
 
 #define MIN_CAPACITY    (10)
 #define GROW_FACTOR     (2)
+#define READ_CHUNK      (4096)
+
+/*
+ * buffer allocation
+ * buffers of at least MMAP_THRESHOLD bytes are anonymous mappings on linux:
+ * they are backed by huge pages where possible, grow in place with mremap
+ * and come zero-filled from the kernel. smaller ones live on the heap.
+ * define S4STR_NO_MMAP to keep everything on the heap.
+ */
+#if defined(__linux__) && defined(_GNU_SOURCE) && !defined(S4STR_NO_MMAP)
+#define S4STR_MMAP
+#include <sys/mman.h>
+#define MMAP_THRESHOLD  (1 << 21)
+#endif
+
+void s4str_allocFailure(void) {
+    fprintf(stderr, "Memory allocation failure\n");
+    exit(2);
+}
+
+#ifdef S4STR_MMAP
+void s4str_adviseHuge(unsigned char* data, size_t cap) {
+#ifdef MADV_HUGEPAGE
+    madvise(data, cap, MADV_HUGEPAGE);
+#endif
+}
+
+// mapped buffers are whole huge pages, so the rounded size is the capacity
+size_t s4str_capacity(size_t cap) {
+    if(cap < MMAP_THRESHOLD) {
+        return cap;
+    }
+    return (cap + MMAP_THRESHOLD - 1) & ~(size_t) (MMAP_THRESHOLD - 1);
+}
+
+unsigned char* s4str_alloc(size_t cap) {
+    if(cap < MMAP_THRESHOLD) {
+        unsigned char* data = calloc(cap, 1);
+        if(data == NULL) {
+            s4str_allocFailure();
+        }
+        return data;
+    }
+    void* data = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(data == MAP_FAILED) {
+        s4str_allocFailure();
+    }
+    s4str_adviseHuge(data, cap);
+    return data;
+}
+
+void s4str_release(unsigned char* data, size_t cap) {
+    if(cap < MMAP_THRESHOLD) {
+        free(data);
+    }
+    else {
+        munmap(data, cap);
+    }
+}
+
+// grows a buffer, zero-filling the new tail
+unsigned char* s4str_realloc(unsigned char* data, size_t cap, size_t newCap) {
+    if(newCap < MMAP_THRESHOLD) {
+        unsigned char* newData = realloc(data, newCap);
+        if(newData == NULL) {
+            s4str_allocFailure();
+        }
+        memset(newData + cap, 0, newCap - cap);
+        return newData;
+    }
+    if(cap < MMAP_THRESHOLD) {
+        // crossing the threshold: move the heap buffer into a mapping
+        unsigned char* newData = s4str_alloc(newCap);
+        memcpy(newData, data, cap);
+        free(data);
+        return newData;
+    }
+    void* newData = mremap(data, cap, newCap, MREMAP_MAYMOVE);
+    if(newData == MAP_FAILED) {
+        s4str_allocFailure();
+    }
+    s4str_adviseHuge(newData, newCap);
+    return newData;
+}
+
+void s4str_zero(unsigned char* data, size_t cap) {
+    if(cap < MMAP_THRESHOLD) {
+        memset(data, 0, cap);
+    }
+    else {
+        // hands the pages back; they fault in again as zeroes
+        madvise(data, cap, MADV_DONTNEED);
+    }
+}
+#else
+#define s4str_capacity(cap) (cap)
+
+unsigned char* s4str_alloc(size_t cap) {
+    unsigned char* data = calloc(cap, 1);
+    if(data == NULL) {
+        s4str_allocFailure();
+    }
+    return data;
+}
+
+#define s4str_release(data, cap) free(data)
+
+unsigned char* s4str_realloc(unsigned char* data, size_t cap, size_t newCap) {
+    unsigned char* newData = realloc(data, newCap);
+    if(newData == NULL) {
+        s4str_allocFailure();
+    }
+    memset(newData + cap, 0, newCap - cap);
+    return newData;
+}
+
+#define s4str_zero(data, cap) memset(data, 0, cap)
+#endif
 
 s4str* s4str_new(size_t capacity) {
     // min capacity for guesses
     if(capacity < MIN_CAPACITY) {
         capacity = MIN_CAPACITY;
     }
+    capacity = s4str_capacity(capacity);
     s4str* res = malloc(sizeof(s4str));
-    res->data = calloc(capacity, sizeof(*res->data));
+    res->data = s4str_alloc(capacity);
     res->cap = capacity;
     res->size = 0;
+#ifdef S4_TELEMETRY
+    res->stat = NULL;
+#endif
     return res;
 }
 
+#ifdef S4_TELEMETRY
+// attributes str's activity to register reg from now on
+void s4str_bind(s4str* str, int reg) {
+    static int registered = 0;
+    if(!registered) {
+        atexit(s4stat_dump);
+        signal(SIGUSR1, s4stat_signal);
+        registered = 1;
+    }
+    if(str->stat != &s4_stats[reg]) {
+        str->stat = &s4_stats[reg];
+        S4STAT(str, allocs, 1);
+        S4STAT_PEAK(str);
+    }
+}
+#endif
+
+// empties and zeroes str for reuse, or makes a new string if str is NULL
+s4str* s4str_reset(s4str* str, size_t capacity) {
+    if(str == NULL) {
+        return s4str_new(capacity);
+    }
+    s4str_zero(str->data, str->cap);
+    str->size = 0;
+    return str;
+}
+
 void s4str_free(s4str* str) {
-    free(str->data);
+    S4STAT(str, frees, 1);
+    s4str_release(str->data, str->cap);
     free(str);
 }
 
@@ -50,17 +800,32 @@ void s4str_growToInclude(s4str* str, int index) {
         while(index >= newCap) {
             newCap *= GROW_FACTOR;
         }
-        void* newMem = realloc(str->data, newCap);
-        if(newMem == NULL) {
-            fprintf(stderr, "Memory allocation failure\n");
-            exit(2);
-        }
-        str->data = newMem;
-        for(size_t i = str->cap; i < newCap; i++) {
-            str->data[i] = 0;
-        }
+        newCap = s4str_capacity(newCap);
+        str->data = s4str_realloc(str->data, str->cap, newCap);
         str->cap = newCap;
+        S4STAT(str, reallocs, 1);
+        S4STAT_PEAK(str);
+    }
+}
+
+// replaces the contents of str with the input up to and including delim,
+// or with the rest of the stream if delim is EOF
+// returns the number of bytes read, which is 0 only at end of stream
+size_t s4str_readUntil(s4str* str, int delim, FILE* input) {
+    size_t size = 0;
+    while(1) {
+        s4str_growToInclude(str, size + READ_CHUNK);
+        // leave room for the terminator
+        size_t room = str->cap - size - 1;
+        size_t n = s4io_readUntil(str->data + size, room, delim, input);
+        size += n;
+        if(n < room || (delim != EOF && str->data[size - 1] == delim)) {
+            break;
+        }
     }
+    str->data[size] = 0;
+    str->size = size;
+    return size;
 }
 
 void s4str_resize(s4str* str, int index) {
@@ -75,6 +840,7 @@ void s4str_resize(s4str* str, int index) {
 }
 
 void s4str_set(s4str* str, int index, int value) {
+    S4STAT(str, sets, 1);
     s4str_growToInclude(str, index);
     str->data[index] = value;
     if(index >= str->size) {
@@ -91,15 +857,20 @@ void s4str_appendString(s4str* str, s4str* other) {
     for(size_t i = 0; i < other->size; i++) {
         str->data[str->size + i] = other->data[i];
     }
+    S4STAT(str, copied, other->size);
     str->size += other->size;
 }
 
 void s4str_copyTo(s4str* to, s4str* from) {
-    free(to->data);
-    to->data = calloc(*to->data, from->cap);
+    s4str_release(to->data, to->cap);
+    to->data = s4str_alloc(from->cap);
     memcpy(to->data, from->data, from->cap);
     to->size = from->size;
     to->cap = from->cap;
+    S4STAT(to, allocs, 1);
+    S4STAT(to, frees, 1);
+    S4STAT(to, copied, from->cap);
+    S4STAT_PEAK(to);
 }
 
 void s4str_puts(s4str* str) {
@@ -107,7 +878,8 @@ void s4str_puts(s4str* str) {
 }
 
 void s4str_puts_to(s4str* str, FILE* output) {
-    fprintf(output, "%s\n", (char*) str->data);
+    s4io_puts((char*) str->data, output);
+    s4io_putc('\n', output);
 }
 
 unsigned char s4str_get(s4str* str, int index) {
@@ -117,6 +889,7 @@ unsigned char s4str_get(s4str* str, int index) {
         exit(1);
     }
     */
+    S4STAT(str, gets, 1);
     s4str_growToInclude(str, index);
     return str->data[index];
 }
@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 
 #define OUTNAME             "temp.c"
 #define COMPILE(name, out)  "gcc " name " -o " out
+#define THREADFLAGS         " -pthread"
 #define RUN(name, out)       out
 #ifdef _WIN32
 #define REMOVE(name)        "del " name
@@ -25,10 +27,15 @@
  * section 2N-1: loop code
  * section 2N: post code
  * ...
+ * 
+ * any code section may define subroutines ({name params : body}) and call
+ * them ((name args)); small bodies are inlined, larger ones become functions
  */
 
 #define OUTPUT(str) fprintf(compileFile, "%s", str)
 #define OUTPUTF(str, ...) fprintf(compileFile, str, __VA_ARGS__)
+#define RESET(str) fprintf(resetFile, "%s", str)
+#define RESETF(str, ...) fprintf(resetFile, str, __VA_ARGS__)
 
 #define FAIL(code, msg, ...) {\
     fprintf(stderr, "(%s:%i) Fatal Error: " msg "\n", __FILE__, __LINE__, __VA_ARGS__);\
@@ -46,21 +53,115 @@
     FAILE(9, "Expected %s register `%c`, got %s", DTYPE_SNAME(expected), c, DTYPE_SNAME(actual))
 
 #define NBUF_MAX (10)
+#define MAX_PARAMS (8)
+// subroutines of at most this many instructions are inlined at each call
+#define INLINE_MAX (8)
+#define CTYPE(dt) (dt == STRING ? "s4str*" : "int")
 
 enum PMODE { SINGLE, LOOP };
 enum DTYPE { UNDEFINED, STRING, NUMBER };
+
+typedef struct subroutine {
+    int arity;
+    int params[MAX_PARAMS];
+    enum DTYPE types[MAX_PARAMS];
+    int size;       // instructions in the body, counting inlined calls
+    unsigned long long uses;    // other registers the body touches, by chrid
+    int emitted;    // s4_sub_<name> has been written out
+    char* body;     // generated C, NULL until defined
+} subroutine;
  
+/*
+ * generated programs keep their registers in file-scope statics:
+ *  s4_reset() puts every register back to its data-section value
+ *  s4_run() is the program body, returning its exit code
+ *  s4_release() frees the string registers
+ * main() then either runs the body once, or once per input record (-b)
+ */
 static char* boilerplate[2] = {
+    "#define _GNU_SOURCE\n"
     "#include <stdio.h>\n"
     "#include <stdlib.h>\n"
     "#include \"s4str.h\"\n"
-    "int main(int argc, char** argv) {\n"
-    "FILE* istream = stdin; FILE* ostream = stdout;\n"
-    "int _; s4str* $ = s4str_new(1);\n"
+    "static FILE* istream; static FILE* ostream; static FILE* s4_input;\n"
+    "static int _; static s4str* $;\n"
     ,
+    "return 0;\n"
     "}\n"
 };
 
+static char* resetBoilerplate = "_ = 0; $ = s4str_reset($, 1);\n";
+
+static char* singleMain =
+    "int main(int argc, char** argv) {\n"
+    "istream = s4_input = stdin; ostream = stdout;\n"
+    "s4_reset();\n"
+    "int status = s4_run(argc, argv);\n"
+    "s4_release();\n"
+    "return status;\n"
+    "}\n";
+
+// takes the record delimiter as its format argument
+static char* batchMain =
+    "static int s4_record(char* program, char* name, FILE* input) {\n"
+    "char* args[] = { program, name, NULL };\n"
+    "istream = s4_input = input; ostream = stdout;\n"
+    "s4_reset();\n"
+    "int status = s4_run(name ? 2 : 1, args);\n"
+    "if(istream != s4_input && istream != stdin) s4io_close(istream);\n"
+    "if(ostream != stdout && ostream != stderr) s4io_close(ostream);\n"
+    "s4io_close(input);\n"
+    "s4io_putc(%1$i, stdout);\n"
+    "return status;\n"
+    "}\n"
+    "int main(int argc, char** argv) {\n"
+    "int status = 0;\n"
+    "for(int i = 1; i < argc; i++) {\n"
+    "FILE* input = fopen(argv[i], \"r\");\n"
+    "if(input == NULL) {\n"
+    "fprintf(stderr, \"Could not open %%s\\n\", argv[i]);\n"
+    "status = 1;\n"
+    "continue;\n"
+    "}\n"
+    "int res = s4_record(argv[0], argv[i], input);\n"
+    "if(res) status = res;\n"
+    "}\n"
+    "if(argc == 1) {\n"
+    "s4str* record = s4str_new(0);\n"
+    "while(s4str_readUntil(record, %1$i, stdin)) {\n"
+    "if(record->data[record->size - 1] == %1$i) record->size--;\n"
+    "FILE* input = fmemopen(record->data, record->size, \"r\");\n"
+    "if(input == NULL) {\n"
+    "fprintf(stderr, \"Could not read record\\n\");\n"
+    "status = 1;\n"
+    "continue;\n"
+    "}\n"
+    "int res = s4_record(argv[0], NULL, input);\n"
+    "if(res) status = res;\n"
+    "}\n"
+    "s4str_free(record);\n"
+    "}\n"
+    "s4_release();\n"
+    "return status;\n"
+    "}\n";
+
+char* readStream(FILE* from) {
+    long size = ftell(from);
+    char* res = malloc(size + 1);
+    rewind(from);
+    res[fread(res, 1, size, from)] = '\0';
+    return res;
+}
+
+void copyStream(FILE* from, FILE* to) {
+    char buf[BUFSIZ];
+    size_t n;
+    rewind(from);
+    while((n = fread(buf, 1, sizeof(buf), from))) {
+        fwrite(buf, 1, n, to);
+    }
+}
+
 int isRegName(int c) {
     return isalpha(c) || isdigit(c) || c == '_' || c == '$';
 }
@@ -82,10 +183,22 @@ int main(int argc, char** argv) {
         }
     }
     int debug = 0;
+    int asyncIO = 0;
+    int batch = 0;
+    int batchDelim = '\n';
+    int telemetry = 0;
     for(int i = 3; i < argc; i++) {
         if(argv[i][0] == '-') {
             switch(argv[i][1]) {
                 case 'd': debug = 1; break;
+                case 'a': asyncIO = 1; break;
+                case 't': telemetry = 1; break;
+                case 'b':
+                    batch = 1;
+                    if(argv[i][2]) {
+                        batchDelim = atoi(argv[i] + 2);
+                    }
+                    break;
                 default: fprintf(stderr, "Warning: Unknown flag `%s`\n", argv[i]); break;
             }
         }
@@ -93,8 +206,19 @@ int main(int argc, char** argv) {
     
     FILE* codeFile = fopen(argv[1], "r");
     FILE* compileFile = fopen(OUTNAME, "w");
+    FILE* resetFile = tmpfile();
     
+    if(asyncIO) {
+        OUTPUT("#define S4_ASYNC_IO\n");
+    }
+    if(telemetry) {
+        OUTPUT("#define S4_TELEMETRY\n");
+    }
     OUTPUT(boilerplate[0]);
+    RESET(resetBoilerplate);
+    if(telemetry) {
+        RESET("s4str_bind($, '$');\n");
+    }
     
     // parse input program
     int cur;
@@ -143,6 +267,7 @@ int main(int argc, char** argv) {
     }
     #define MODE_COUNT (26 + 26 + 10 + 2)
     enum DTYPE modes[MODE_COUNT] = { UNDEFINED };
+    subroutine subroutines[MODE_COUNT] = { { 0 } };
     int chrid(int c) {
         if('a' <= c && c <= 'z') {
             return c - 'a';
@@ -189,11 +314,14 @@ int main(int argc, char** argv) {
     modes[chrid('_')] = NUMBER;
     modes[chrid('$')] = STRING;
     
+    // registers referenced since the current subroutine body began
+    unsigned long long registerUses = 0;
     enum DTYPE getMode(int reg) {
         enum DTYPE t = modes[chrid(reg)];
         if(t == UNDEFINED) {
             FAILE(8, "Undeclared register `%c`", reg);
         }
+        registerUses |= 1ULL << chrid(reg);
         return t;
     }
     // parse data section
@@ -247,28 +375,51 @@ int main(int argc, char** argv) {
         if(mode == 's') {
             int val = atoi(nbuf);
             // TODO: assert val >= 0
-            OUTPUTF("s4str* %c = s4str_new(%i);\n", reg, val + 1);
+            OUTPUTF("static s4str* %c;\n", reg);
+            RESETF("%c = s4str_reset(%c, %i);\n", reg, reg, val + 1);
+            if(telemetry) {
+                RESETF("s4str_bind(%c, '%c');\n", reg, reg);
+            }
             for(int ctr = 0; ctr < val; ctr++) {
                 next(&cur);
                 if(feof(codeFile) || cur == '.') {
                     break;
                 }
-                OUTPUTF("s4str_set(%c, %i, %i); ", reg, ctr, cur);
+                RESETF("s4str_set(%c, %i, %i); ", reg, ctr, cur);
             }
-            OUTPUT("\n");
+            RESET("\n");
             // below line unnecessary since calloc is called
             // OUTPUTF("%c[%i] = 0;\n", reg, val);
             // OUTPUTF("size_t %c_size = %i;\n", reg, val);
             modes[chrid(reg)] = STRING;
         }
         else if(mode == 'n') {
-            OUTPUTF("int %c = %s;\n", reg, nbuf);
+            OUTPUTF("static int %c;\n", reg);
+            RESETF("%c = %s;\n", reg, nbuf);
             modes[chrid(reg)] = NUMBER;
         }
     }
     
+    OUTPUT("static void s4_reset(void) {\n");
+    copyStream(resetFile, compileFile);
+    fclose(resetFile);
+    OUTPUT("}\n");
+    
+    // a batch run may end without any record having allocated the registers
+    OUTPUT("static void s4_release(void) {\n");
+    for(int id = 0; id < MODE_COUNT; id++) {
+        if(modes[id] == STRING) {
+            int chr = idchr(id);
+            OUTPUTF("if(%c) s4str_free(%c);\n", chr, chr);
+        }
+    }
+    OUTPUT("}\n");
+    
     // -- parse code -- //
     
+    // the body of s4_run is buffered so subroutine functions can precede it
+    FILE* mainFile = compileFile;
+    
     void readRegister(int* reg, enum DTYPE expected) {
         nextSkipSpace(&cur);
         *reg = cur;
@@ -298,357 +449,601 @@ int main(int argc, char** argv) {
         }
     }
     
-    int expectingClose = 0;
-    enum PMODE mode = SINGLE;
-    while(1) {
-        nextSkipSpace(&cur);
-        if(feof(codeFile)) break;
-        if(cur == ';') {
-            if(mode == LOOP) {
+    // parses code sections up to the end of the file, or up to the `}`
+    // closing subroutine `sub` (-1 at top level)
+    int instructionCount = 0;
+    subroutine* defining = NULL;
+    int isParam(int reg) {
+        for(int i = 0; defining != NULL && i < defining->arity; i++) {
+            if(defining->params[i] == reg) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    auto int parseSubroutine(void);
+    auto int emitCall(void);
+    auto void emitFunction(int name, subroutine* def);
+    int parseCode(int sub) {
+        int expectingClose = 0;
+        enum PMODE mode = SINGLE;
+        while(1) {
+            nextSkipSpace(&cur);
+            if(feof(codeFile)) {
+                if(sub != -1) {
+                    FAIL(13, "Unterminated subroutine `%c`", sub);
+                }
+                break;
+            }
+            if(cur == ';') {
+                if(mode == LOOP) {
+                    OUTPUT("}\n");
+                }
+                mode = mode == SINGLE ? LOOP : SINGLE;
+                if(mode == LOOP) {
+                    // nextSkipSpace(&cur);
+                    readRegister(&cur, NUMBER);
+                    OUTPUTF("while(%c) {\n", cur);
+                }
+            }
+            else if(cur == '.') {
+                if(expectingClose == 0) {
+                    FAIL(11, "%s", "Unexpected closer `.`");
+                }
                 OUTPUT("}\n");
+                expectingClose--;
             }
-            mode = mode == SINGLE ? LOOP : SINGLE;
-            if(mode == LOOP) {
-                // nextSkipSpace(&cur);
-                readRegister(&cur, NUMBER);
-                OUTPUTF("while(%c) {\n", cur);
+            else if(cur == ':') {
+                if(expectingClose == 0) {
+                    FAIL(11, "%s", "Unexpected join-closer `:`");
+                }
+                OUTPUT("} else {\n");
             }
-        }
-        else if(cur == '.') {
-            if(expectingClose == 0) {
-                FAIL(11, "%s", "Unexpected closer `.`");
+            // subroutine definition
+            else if(cur == '{') {
+                if(sub != -1) {
+                    FAIL(17, "Cannot define a subroutine within subroutine `%c`", sub);
+                }
+                int err = parseSubroutine();
+                if(err) {
+                    return err;
+                }
             }
-            OUTPUT("}\n");
-            expectingClose--;
-        }
-        else if(cur == ':') {
-            if(expectingClose == 0) {
-                FAIL(11, "%s", "Unexpected join-closer `:`");
+            else if(cur == '}') {
+                if(sub == -1) {
+                    FAIL(11, "%s", "Unexpected subroutine closer `}`");
+                }
+                if(expectingClose != 0) {
+                    FAIL(11, "Unclosed block in subroutine `%c`", sub);
+                }
+                break;
             }
-            OUTPUT("} else {\n");
-        }
-        else if(!isRegName(cur)) {
-            FAIL(2, "Expected register name (got `%c`)", cur);
-        }
-        else {
-            char reg = cur;
-            enum DTYPE rtype = getMode(reg);
-            nextSkipSpace(&cur);
-            char cmd = cur;
-            switch(cmd) {
-                // binary math operators
-                case '+':
-                case '-':
-                case '*':
-                case '/':
-                case '%':
-                case '<':
-                case '>':
-                case '&':
-                case '|':
-                case '=':
-                case '^': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: {
-                            if(cmd == '+') {
-                                int rhs, out;
-                                nextSkipSpace(&rhs);
-                                enum DTYPE rhstype = getMode(rhs);
-                                readRegisterCons(&out, STRING);
-                                if(out != reg) {
-                                    OUTPUTF("s4str_copyTo(%c, %c);\n", out, reg);
+            // subroutine call
+            else if(cur == '(') {
+                int err = emitCall();
+                if(err) {
+                    return err;
+                }
+            }
+            else if(!isRegName(cur)) {
+                FAIL(2, "Expected register name (got `%c`)", cur);
+            }
+            else {
+                instructionCount++;
+                char reg = cur;
+                enum DTYPE rtype = getMode(reg);
+                nextSkipSpace(&cur);
+                char cmd = cur;
+                switch(cmd) {
+                    // binary math operators
+                    case '+':
+                    case '-':
+                    case '*':
+                    case '/':
+                    case '%':
+                    case '<':
+                    case '>':
+                    case '&':
+                    case '|':
+                    case '=':
+                    case '^': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: {
+                                if(cmd == '+') {
+                                    int rhs, out;
+                                    nextSkipSpace(&rhs);
+                                    enum DTYPE rhstype = getMode(rhs);
+                                    readRegisterCons(&out, STRING);
+                                    if(out != reg) {
+                                        OUTPUTF("s4str_copyTo(%c, %c);\n", out, reg);
+                                    }
+                                    if(rhstype == STRING) {
+                                        OUTPUTF("s4str_appendString(%c, %c);\n", out, rhs);
+                                    }
+                                    else {
+                                        OUTPUTF("s4str_appendChar(%c, %c);\n", out, rhs);
+                                    }
                                 }
-                                if(rhstype == STRING) {
-                                    OUTPUTF("s4str_appendString(%c, %c);\n", out, rhs);
+                                else {
+                                    FAIL_UNEXPECTED(reg, rtype, NUMBER);
+                                }
+                                break;
+                            }
+                            case NUMBER: {
+                                int rhs, out;
+                                readRegister(&rhs, NUMBER);
+                                readRegisterCons(&out, NUMBER);
+                                if(cmd == '=') {
+                                    OUTPUTF("%c = %c == %c;\n", out, reg, rhs);
                                 }
                                 else {
-                                    OUTPUTF("s4str_appendChar(%c, %c);\n", out, rhs);
+                                    OUTPUTF("%c = %c %c %c;\n", out, reg, cmd, rhs);
                                 }
+                                break;
                             }
-                            else {
+                        }
+                        break;
+                    }
+                    // unary operators
+                    case '~':
+                    case '_':
+                    case '!': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING:
                                 FAIL_UNEXPECTED(reg, rtype, NUMBER);
+                                break;
+                            case NUMBER: {
+                                int out;
+                                readRegisterCons(&out, NUMBER);
+                                OUTPUTF("%c = %c%c;\n", out, cmd, reg);
+                                break;
                             }
-                            break;
                         }
-                        case NUMBER: {
-                            int rhs, out;
-                            readRegister(&rhs, NUMBER);
-                            readRegisterCons(&out, NUMBER);
-                            if(cmd == '=') {
-                                OUTPUTF("%c = %c == %c;\n", out, reg, rhs);
-                            }
-                            else {
-                                OUTPUTF("%c = %c %c %c;\n", out, reg, cmd, rhs);
+                        break;
+                    }
+                
+                    // assign
+                    case '$': {
+                        int other;
+                        readRegister(&other, rtype);
+                        OUTPUTF("%c = %c;\n", reg, other);
+                        break;
+                    }
+                
+                    // charat
+                    case '@': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: {
+                                int index, out;
+                                readRegister(&index, NUMBER);
+                                readRegisterCons(&out, NUMBER);
+                                OUTPUTF("%c = s4str_get(%c, %c);\n", out, reg, index);
+                                break;
                             }
-                            break;
+                            case NUMBER:
+                                FAIL_UNEXPECTED(reg, rtype, STRING);
+                                break;
                         }
+                        break;
                     }
-                    break;
-                }
-                // unary operators
-                case '~':
-                case '_':
-                case '!': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING:
-                            FAIL_UNEXPECTED(reg, rtype, NUMBER);
-                            break;
-                        case NUMBER: {
-                            int out;
-                            readRegisterCons(&out, NUMBER);
-                            OUTPUTF("%c = %c%c;\n", out, cmd, reg);
-                            break;
+                
+                    // charset
+                    case '#': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: {
+                                int index, value;
+                                readRegister(&index, NUMBER);
+                                readRegister(&value, NUMBER);
+                                OUTPUTF("s4str_set(%c, %c, %c);\n", reg, index, value);
+                                break;
+                            }
+                            case NUMBER:
+                                FAIL_UNEXPECTED(reg, rtype, STRING);
+                                break;
                         }
+                        break;
                     }
-                    break;
-                }
-                
-                // assign
-                case '$': {
-                    int other;
-                    readRegister(&other, rtype);
-                    OUTPUTF("%c = %c;\n", reg, other);
-                    break;
-                }
                 
-                // charat
-                case '@': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: {
-                            int index, out;
-                            readRegister(&index, NUMBER);
-                            readRegisterCons(&out, NUMBER);
-                            OUTPUTF("%c = s4str_get(%c, %c);\n", out, reg, index);
-                            break;
+                    // arg
+                    case 'a': {
+                        int index;
+                        readRegister(&index, NUMBER);
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: {
+                                OUTPUTF("s4str_free(%c);\n", reg);
+                                OUTPUTF("%c = s4str_from(argv[%c]);\n", reg, index);
+                                // a parameter is bound to its argument once the call returns
+                                if(telemetry && !isParam(reg)) {
+                                    OUTPUTF("s4str_bind(%c, '%c');\n", reg, reg);
+                                }
+                                break;
+                            }
+                            case NUMBER: {
+                                FAIL_TODO();
+                                break;
+                            }
                         }
-                        case NUMBER:
-                            FAIL_UNEXPECTED(reg, rtype, STRING);
-                            break;
+                        break;
                     }
-                    break;
-                }
                 
-                // charset
-                case '#': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: {
-                            int index, value;
-                            readRegister(&index, NUMBER);
-                            readRegister(&value, NUMBER);
-                            OUTPUTF("s4str_set(%c, %c, %c);\n", reg, index, value);
-                            break;
+                    // putchar
+                    case 'c': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING:
+                                OUTPUTF("s4io_puts((char*) %c->data, ostream);\n", reg);
+                                break;
+                            case NUMBER: {
+                                OUTPUTF("s4io_putc(%c, ostream);\n", reg);
+                                break;
+                            }
                         }
-                        case NUMBER:
-                            FAIL_UNEXPECTED(reg, rtype, STRING);
-                            break;
+                        break;
                     }
-                    break;
-                }
                 
-                // arg
-                case 'a': {
-                    int index;
-                    readRegister(&index, NUMBER);
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: {
-                            OUTPUTF("s4str_free(%c);\n", reg);
-                            OUTPUTF("%c = s4str_from(argv[%c]);\n", reg, index);
-                            break;
-                        }
-                        case NUMBER: {
-                            FAIL_TODO();
-                            break;
+                    // debug
+                    case 'd': {
+                        OUTPUTF("s4io_puts(\"REGISTER '%c' = \", ostream);\n", reg);
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: OUTPUTF("s4str_puts_to(%c, ostream);\n", reg); break;
+                            case NUMBER: OUTPUTF("fprintf(stderr, \"%%i\\n\", %c);\n", reg); break;
                         }
+                        break;
                     }
-                    break;
-                }
                 
-                // putchar
-                case 'c': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING:
-                            OUTPUTF("fprintf(ostream, \"%%s\", (char*) %c->data);\n", reg);
-                            break;
-                        case NUMBER: {
-                            OUTPUTF("fputc(ostream, %c);\n", reg);
-                            break;
+                    // exit
+                    case 'e': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: FAIL_TODO(); break;
+                            case NUMBER:
+                                if(sub != -1) {
+                                    FAIL(12, "Cannot exit from within subroutine `%c`", sub);
+                                }
+                                OUTPUTF("return %c;\n", reg);
+                                break;
                         }
+                        break;
                     }
-                    break;
-                }
                 
-                // debug
-                case 'd': {
-                    OUTPUTF("fprintf(ostream, \"%%s\", \"REGISTER '%c' = \");\n", reg);
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: OUTPUTF("s4str_puts_to(%c, ostream);\n", reg); break;
-                        case NUMBER: OUTPUTF("fprintf(stderr, \"%%i\\n\", %c);\n", reg); break;
+                    // input file stream
+                    case 'f': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: {
+                                int mode;
+                                readRegister(&mode, NUMBER);
+                                OUTPUTF("if(%c) {\n", mode);
+                                // the old stream is unreachable once replaced
+                                OUTPUT("if(istream != s4_input) s4io_forget(istream);\n");
+                                OUTPUTF("istream = fopen(%c->data, fileModeNumber(%c));\n", reg, mode);
+                                OUTPUT("} else {\n");
+                                // the record stream is closed by the batch driver
+                                if(batch) {
+                                    OUTPUT("if(istream != s4_input) ");
+                                }
+                                // s4_input is stdin, or in batch mode the current record
+                                OUTPUT("s4io_close(istream);\nistream = s4_input;\n");
+                                OUTPUT("}\n");
+                                break;
+                            }
+                            case NUMBER:
+                                // TODO: other inputs?
+                                OUTPUT("if(istream != s4_input) s4io_forget(istream);\n");
+                                OUTPUTF("istream = s4_input; //from %c\n", reg);
+                                break;
+                        }
+                        break;
                     }
-                    break;
-                }
                 
-                // exit
-                case 'e': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: FAIL_TODO(); break;
-                        case NUMBER: OUTPUTF("return %c;\n", reg); break;
+                    // output file stream
+                    case 'F': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: {
+                                int mode;
+                                readRegister(&mode, NUMBER);
+                                OUTPUT("s4io_sync(ostream);\n");
+                                OUTPUTF("if(%c) {\n", mode);
+                                OUTPUT("if(ostream != stdout && ostream != stderr) s4io_forget(ostream);\n");
+                                OUTPUTF("ostream = fopen(%c->data, fileModeNumber(%c));\n", reg, mode);
+                                OUTPUT("} else {\n");
+                                if(batch) {
+                                    OUTPUT("if(ostream != stdout && ostream != stderr) ");
+                                }
+                                OUTPUT("s4io_close(ostream);\nostream = stdout;\n");
+                                OUTPUT("}\n");
+                                break;
+                            }
+                            case NUMBER:
+                                // TODO: other inputs?
+                                OUTPUT("s4io_sync(ostream);\n");
+                                OUTPUT("if(ostream != stdout && ostream != stderr) s4io_forget(ostream);\n");
+                                OUTPUTF("ostream = %c == 2 ? stderr : stdout;\n", reg);
+                                break;
+                        }
+                        break;
                     }
-                    break;
-                }
                 
-                // input file stream
-                case 'f': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: {
-                            int mode;
-                            readRegister(&mode, NUMBER);
-                            OUTPUTF("if(%c) {\n", mode);
-                            OUTPUTF("istream = fopen(%c->data, fileModeNumber(%c));\n", reg, mode);
-                            OUTPUT("} else {\n");
-                            OUTPUT("fclose(istream);\nistream = stdin;\n");
-                            OUTPUT("}\n");
-                            break;
+                    // getchar
+                    case 'g': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: OUTPUTF("*%c->data = s4io_getc(istream);\n", reg); break;
+                            case NUMBER: OUTPUTF("%c = s4io_getc(istream);\n", reg); break;
                         }
-                        case NUMBER:
-                            // TODO: other inputs?
-                            OUTPUTF("istream = stdin; //from %c\n", reg);
-                            break;
+                        break;
                     }
-                    break;
-                }
                 
-                // output file stream
-                case 'F': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: {
-                            int mode;
-                            readRegister(&mode, NUMBER);
-                            OUTPUTF("if(%c) {\n", mode);
-                            OUTPUTF("ostream = fopen(%c->data, fileModeNumber(%c));\n", reg, mode);
-                            OUTPUT("} else {\n");
-                            OUTPUT("fclose(ostream);\nostream = stdout;\n");
-                            OUTPUT("}\n");
-                            break;
+                    // input
+                    case 'i': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING:
+                                OUTPUTF("s4str_readUntil(%c, '\\n', istream);\n", reg);
+                                break;
+                            case NUMBER:
+                                OUTPUTF("s4io_getint(&%c, istream);\n", reg);
+                                break;
                         }
-                        case NUMBER:
-                            // TODO: other inputs?
-                            OUTPUTF("ostream = %c == 2 ? stderr : stdout;\n", reg);
-                            break;
+                        break;
                     }
-                    break;
-                }
                 
-                // getchar
-                case 'g': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: OUTPUTF("*%c->data = fgetc(istream);\n", reg); break;
-                        case NUMBER: OUTPUTF("%c = fgetc(istream);\n", reg); break;
+                    // input rest of stream
+                    case 'I': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING:
+                                OUTPUTF("s4str_readUntil(%c, EOF, istream);\n", reg);
+                                break;
+                            case NUMBER:
+                                FAIL_UNEXPECTED(reg, rtype, STRING);
+                                break;
+                        }
+                        break;
                     }
-                    break;
-                }
                 
-                // input
-                case 'i': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING:
-                            // TODO: fix
-                            OUTPUTF("fgets(%c->data, %c->size, stdin);\n", reg, reg);
-                            break;
-                        case NUMBER:
-                            OUTPUTF("scanf(\" %%i\", &%c);\n", reg);
-                            break;
+                    // resize
+                    case 'r': {
+                        switch(rtype) {
+                            case UNDEFINED: break;
+                            case STRING: {
+                                int index;
+                                readRegister(&index, NUMBER);
+                                OUTPUTF("s4str_resize(%c, %c);\n", reg, index);
+                                break;
+                            }
+                            case NUMBER:
+                                FAIL_UNEXPECTED(reg, rtype, STRING);
+                                break;
+                        }
+                        break;
                     }
-                    break;
-                }
                 
-                // resize
-                case 'r': {
-                    switch(rtype) {
-                        case UNDEFINED: break;
-                        case STRING: {
-                            int index;
-                            readRegister(&index, NUMBER);
-                            OUTPUTF("s4str_resize(%c, %c);\n", reg, index);
-                            break;
+                    // size
+                    case 's': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: {
+                                int arg2;
+                                readRegister(&arg2, NUMBER);
+                                OUTPUTF("%c = %c->size;\n", arg2, reg);
+                                break;
+                            }
+                            case NUMBER:
+                                FAIL_UNEXPECTED(reg, rtype, STRING);
+                                break;
                         }
-                        case NUMBER:
-                            FAIL_UNEXPECTED(reg, rtype, STRING);
-                            break;
+                        break;
                     }
-                    break;
-                }
                 
-                // size
-                case 's': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: {
-                            int arg2;
-                            readRegister(&arg2, NUMBER);
-                            OUTPUTF("%c = %c->size;\n", arg2, reg);
-                            break;
+                    // print
+                    case 'p': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: OUTPUTF("s4str_puts_to(%c, ostream);\n", reg); break;
+                            case NUMBER:
+                                OUTPUTF("s4io_putintln(%c, ostream);\n", reg);
+                                break;
                         }
-                        case NUMBER:
-                            FAIL_UNEXPECTED(reg, rtype, STRING);
-                            break;
+                        break;
                     }
-                    break;
-                }
                 
-                // print
-                case 'p': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: OUTPUTF("s4str_puts_to(%c, ostream);\n", reg); break;
-                        case NUMBER: OUTPUTF("fprintf(ostream, \"%%i\\n\", %c);\n", reg); break;
+                    // if
+                    case '?': {
+                        switch(rtype) {
+                            case UNDEFINED: break; // handled by getMode
+                            case STRING: FAIL_TODO(); break;
+                            case NUMBER:
+                                OUTPUTF("if(%c) {\n", reg);
+                                expectingClose++;
+                                break;
+                        }
+                        break;
                     }
-                    break;
-                }
                 
-                // if
-                case '?': {
-                    switch(rtype) {
-                        case UNDEFINED: break; // handled by getMode
-                        case STRING: FAIL_TODO(); break;
-                        case NUMBER:
-                            OUTPUTF("if(%c) {\n", reg);
-                            expectingClose++;
-                            break;
-                    }
-                    break;
+                    default:
+                        FAIL(7, "Unknown command `%c` for `%c`", cmd, reg);
+                        break;
                 }
-                
-                default:
-                    FAIL(7, "Unknown command `%c` for `%c`", cmd, reg);
-                    break;
             }
         }
+    
+        
+        if(mode == LOOP) {
+            OUTPUT("}\n");
+        }
+        return 0;
+    }
+    
+    // `{` name (param type)* `:` body `}`
+    int parseSubroutine(void) {
+        nextSkipSpace(&cur);
+        int name = cur;
+        subroutine* def = &subroutines[chrid(name)];
+        if(def->body != NULL) {
+            FAIL(14, "Subroutine `%c` already defined", name);
+        }
+        def->arity = 0;
+        while(1) {
+            nextSkipSpace(&cur);
+            if(feof(codeFile) || cur == ':') break;
+            if(!isalpha(cur)) {
+                FAIL(2, "Expected parameter register name (got `%c`)", cur);
+            }
+            if(def->arity == MAX_PARAMS) {
+                FAIL(15, "Subroutine `%c` cannot take more than %i parameters", name, MAX_PARAMS);
+            }
+            def->params[def->arity] = cur;
+            nextSkipSpace(&cur);
+            if(cur != 's' && cur != 'n') {
+                FAIL(3, "Expected mode 's' or 'n' (got `%c`)", cur);
+            }
+            def->types[def->arity] = cur == 's' ? STRING : NUMBER;
+            def->arity++;
+        }
+        
+        // the body sees its parameters in place of any registers of the same name
+        enum DTYPE outerModes[MODE_COUNT];
+        memcpy(outerModes, modes, sizeof(modes));
+        for(int i = 0; i < def->arity; i++) {
+            modes[chrid(def->params[i])] = def->types[i];
+        }
+        FILE* outerFile = compileFile;
+        int outerCount = instructionCount;
+        compileFile = tmpfile();
+        instructionCount = 0;
+        registerUses = 0;
+        defining = def;
+        
+        int err = parseCode(name);
+        if(err) {
+            return err;
+        }
+        
+        def->size = instructionCount;
+        def->uses = registerUses;
+        for(int i = 0; i < def->arity; i++) {
+            def->uses &= ~(1ULL << chrid(def->params[i]));
+        }
+        def->body = readStream(compileFile);
+        fclose(compileFile);
+        compileFile = outerFile;
+        instructionCount = outerCount;
+        defining = NULL;
+        memcpy(modes, outerModes, sizeof(modes));
+        
+        if(def->size > INLINE_MAX) {
+            emitFunction(name, def);
+        }
+        return 0;
     }
     
-    if(mode == LOOP) {
-        OUTPUT("}\n");
+    // writes s4_sub_<name> at file scope, where the body sees the registers
+    void emitFunction(int name, subroutine* def) {
+        if(!def->emitted) {
+            def->emitted = 1;
+            fprintf(mainFile, "static void s4_sub_%c(int argc, char** argv", name);
+            for(int i = 0; i < def->arity; i++) {
+                fprintf(mainFile, ", %s %c_ref", def->types[i] == STRING ? "s4str**" : "int*", def->params[i]);
+            }
+            fprintf(mainFile, ") {\n");
+            for(int i = 0; i < def->arity; i++) {
+                fprintf(mainFile, "%s %c = *%c_ref;\n", CTYPE(def->types[i]), def->params[i], def->params[i]);
+            }
+            fprintf(mainFile, "%s", def->body);
+            for(int i = 0; i < def->arity; i++) {
+                fprintf(mainFile, "*%c_ref = %c;\n", def->params[i], def->params[i]);
+            }
+            fprintf(mainFile, "}\n");
+        }
     }
     
-    for(int id = 0; id < MODE_COUNT; id++) {
-        if(modes[id] == STRING) {
-            int chr = idchr(id);
-            OUTPUTF("s4str_free(%c);\n", chr);
+    // `(` name arg*
+    // arguments are copied in, and copied back out unless they are constants,
+    // so an inlined body behaves exactly like the function it would become.
+    // a body is not inlined where the caller's parameters would shadow the
+    // registers it uses; it is called as a function there instead
+    int emitCall(void) {
+        nextSkipSpace(&cur);
+        int name = cur;
+        subroutine* def = &subroutines[chrid(name)];
+        if(def->body == NULL) {
+            FAIL(16, "Undefined subroutine `%c`", name);
+        }
+        int args[MAX_PARAMS];
+        for(int i = 0; i < def->arity; i++) {
+            readRegister(&args[i], def->types[i]);
+        }
+        OUTPUT("{\n");
+        for(int i = 0; i < def->arity; i++) {
+            OUTPUTF("%s s4_t%i = %c;\n", CTYPE(def->types[i]), i, args[i]);
+        }
+        int shadowed = 0;
+        for(int i = 0; defining != NULL && i < defining->arity; i++) {
+            if(def->uses & (1ULL << chrid(defining->params[i]))) {
+                shadowed = 1;
+            }
+        }
+        if(def->size > INLINE_MAX || shadowed) {
+            emitFunction(name, def);
+            OUTPUTF("s4_sub_%c(argc, argv", name);
+            for(int i = 0; i < def->arity; i++) {
+                OUTPUTF(", &s4_t%i", i);
+            }
+            OUTPUT(");\n");
+            instructionCount++;
+        }
+        else {
+            OUTPUT("{\n");
+            for(int i = 0; i < def->arity; i++) {
+                OUTPUTF("%s %c = s4_t%i;\n", CTYPE(def->types[i]), def->params[i], i);
+            }
+            OUTPUT(def->body);
+            for(int i = 0; i < def->arity; i++) {
+                OUTPUTF("s4_t%i = %c;\n", i, def->params[i]);
+            }
+            OUTPUT("}\n");
+            instructionCount += def->size;
+            registerUses |= def->uses;
+        }
+        for(int i = 0; i < def->arity; i++) {
+            if(!isdigit(args[i])) {
+                OUTPUTF("%c = s4_t%i;\n", args[i], i);
+                // the body may have replaced the string, e.g. with `a`
+                if(telemetry && def->types[i] == STRING && !isParam(args[i])) {
+                    OUTPUTF("s4str_bind(%c, '%c');\n", args[i], args[i]);
+                }
+            }
         }
+        OUTPUT("}\n");
+        return 0;
     }
     
+    compileFile = tmpfile();
+    int err = parseCode(-1);
+    if(err) {
+        return err;
+    }
+    FILE* runFile = compileFile;
+    compileFile = mainFile;
+    
+    OUTPUT("static int s4_run(int argc, char** argv) {\n");
+    copyStream(runFile, compileFile);
+    fclose(runFile);
     OUTPUT(boilerplate[1]);
+    if(batch) {
+        OUTPUTF(batchMain, batchDelim);
+    }
+    else {
+        OUTPUT(singleMain);
+    }
     
     fclose(compileFile);
     
@@ -656,10 +1051,11 @@ int main(int argc, char** argv) {
     char command[COMMANDBUFSIZE];
     snprintf(command, COMMANDBUFSIZE,
         "%s"
-        COMPILE(OUTNAME, "%s")
+        COMPILE(OUTNAME, "%s") "%s"
         " && " REMOVE(OUTNAME),
         debug ? "cat " OUTNAME " && " : "",
-        outputName
+        outputName,
+        asyncIO ? THREADFLAGS : ""
     );
         // " && " RUN(OUTNAME, "%s")
     